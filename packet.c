@@ -1,7 +1,22 @@
 #include "packet.h"
 
-uint16_t compute_checksum(uint8_t *data, size_t length) {
-    uint32_t sum = 0;
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+// Add data to a running one's complement sum. odd says data starts in the low byte of a word,
+// which lets a packet be summed in pieces (e.g. a 15-byte header followed by its payload).
+static uint32_t checksum_add(uint32_t sum, const uint8_t *data, size_t length, int odd) {
+    if (odd && length > 0) {
+        sum += data[0];
+        if (sum > 0xFFFF) {
+            sum -= 0xFFFF;
+        }
+        data++;
+        length--;
+    }
 
     // Sum all 16-bit words
     for (size_t i = 0; i + 1 < length; i += 2) {
@@ -21,18 +36,128 @@ uint16_t compute_checksum(uint8_t *data, size_t length) {
         }
     }
 
+    return sum;
+}
+
+uint16_t compute_checksum(uint8_t *data, size_t length) {
     // One's complement
-    return ~sum & 0xFFFF;
+    return ~checksum_add(0, data, length, 0) & 0xFFFF;
 }
 
-void serialize_packet(Packet *packet, uint8_t *buffer) {
-    PacketHeader *header = &packet->header;
+// Software CRC32C (Castagnoli, reflected polynomial 0x82F63B78), one table lookup per byte
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *data, size_t length) {
+    static uint32_t table[256];
+    static int table_ready = 0;
 
+    if (!table_ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+            }
+            table[i] = c;
+        }
+        table_ready = 1;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// SSE4.2 crc32 instruction, eight bytes per step
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *data, size_t length) {
+    uint64_t crc64 = crc;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+// ARMv8 CRC32C instructions, eight bytes per step
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *data, size_t length) {
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+        data += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+// CRC32C over data, continuing from crc (pass 0 to start). Uses CRC instructions when the CPU has them.
+uint32_t compute_crc32c(uint32_t crc, const uint8_t *data, size_t length) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    static int has_sse42 = -1;
+    if (has_sse42 < 0) has_sse42 = __builtin_cpu_supports("sse4.2");
+    crc = has_sse42 ? crc32c_hw(crc, data, length) : crc32c_sw(crc, data, length);
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc = crc32c_hw(crc, data, length);
+#else
+    crc = crc32c_sw(crc, data, length);
+#endif
+    return ~crc;
+}
+
+// Check the 16-bit checksum of a received packet, and that its length field matches the datagram
+// so deserialize_packet cannot copy past it. Zeroes the checksum field in the buffer.
+int verify_checksum(uint8_t *buffer, size_t length) {
+    if (length < HEADER_SIZE) return 0;
+
+    uint16_t payload_length;
+    memcpy(&payload_length, buffer + 10, sizeof(payload_length));
+    if (ntohs(payload_length) > MAX_PAYLOAD_SIZE || ntohs(payload_length) != length - HEADER_SIZE) return 0;
+
+    uint16_t received_checksum;
+    memcpy(&received_checksum, buffer + 8, sizeof(received_checksum));
+    received_checksum = ntohs(received_checksum);
+
+    // Zero out the checksum field in the buffer for calculation
+    buffer[8] = 0;
+    buffer[9] = 0;
+
+    return compute_checksum(buffer, length) == received_checksum;
+}
+
+// Check the CRC32C trailer of a received DATA packet against its header and payload
+int verify_crc32c(uint8_t *buffer, size_t length) {
+    if (length < HEADER_SIZE + CRC_SIZE) return 0;
+
+    uint16_t payload_length;
+    memcpy(&payload_length, buffer + 10, sizeof(payload_length));
+    if (ntohs(payload_length) > MAX_PAYLOAD_SIZE || ntohs(payload_length) != length - HEADER_SIZE - CRC_SIZE) return 0;
+
+    uint32_t received_crc;
+    memcpy(&received_crc, buffer + length - CRC_SIZE, sizeof(received_crc));
+    return compute_crc32c(0, buffer, length - CRC_SIZE) == ntohl(received_crc);
+}
+
+// Write the header fields in network byte order with the checksum field zeroed;
+// the only place that knows the header layout
+static void encode_header(PacketHeader *header, uint8_t *buffer) {
     // Convert header fields to network byte order
     uint32_t seq_num = htonl(header->seq_num);
     uint32_t ack_num = htonl(header->ack_num);
     uint16_t length = htons(header->length);
     uint8_t type = header->type;
+    uint16_t window = htons(header->window);
     uint16_t checksum = 0; // Initialize checksum to zero
 
     // Serialize header fields
@@ -41,19 +166,42 @@ void serialize_packet(Packet *packet, uint8_t *buffer) {
     memcpy(buffer + 8, &checksum, sizeof(checksum)); // Placeholder for checksum
     memcpy(buffer + 10, &length, sizeof(length));
     memcpy(buffer + 12, &type, sizeof(type));
+    memcpy(buffer + 13, &window, sizeof(window));
+}
+
+void serialize_packet(Packet *packet, uint8_t *buffer) {
+    serialize_segment_header(&packet->header, packet->payload, buffer, NULL);
 
     // Copy payload
-    memcpy(buffer + HEADER_SIZE, packet->payload, header->length);
+    memcpy(buffer + HEADER_SIZE, packet->payload, packet->header.length);
+}
+
+// Serialize only the header of a packet whose payload stays where it is (e.g. in a read-ahead block),
+// for sending header and payload together with sendmsg. The check is computed over the payload in place:
+// the 16-bit checksum goes into the header, or with crc given, the CRC32C trailer goes into crc instead
+// and the checksum field is left zero.
+void serialize_segment_header(PacketHeader *header, const uint8_t *payload, uint8_t *buffer, uint8_t *crc) {
+    encode_header(header, buffer);
+
+    if (crc) {
+        // CRC over header + payload, in network byte order
+        uint32_t value = compute_crc32c(compute_crc32c(0, buffer, HEADER_SIZE), payload, header->length);
+        value = htonl(value);
+        memcpy(crc, &value, sizeof(value));
+        return;
+    }
 
     // Compute checksum over the entire packet (header + payload)
-    checksum = compute_checksum(buffer, HEADER_SIZE + header->length);
-    checksum = htons(checksum); // Convert checksum to network byte order
+    uint32_t sum = checksum_add(0, buffer, HEADER_SIZE, 0);
+    sum = checksum_add(sum, payload, header->length, HEADER_SIZE % 2);
+    uint16_t checksum = htons(~sum & 0xFFFF); // Convert checksum to network byte order
 
     // Insert checksum into buffer
     memcpy(buffer + 8, &checksum, sizeof(checksum));
 }
 
-void deserialize_packet(uint8_t *buffer, Packet *packet) {
+// Returns -1 without copying the payload if the length field would overflow Packet.payload
+int deserialize_packet(uint8_t *buffer, Packet *packet) {
     PacketHeader *header = &packet->header;
 
     // Extract header fields
@@ -62,13 +210,17 @@ void deserialize_packet(uint8_t *buffer, Packet *packet) {
     memcpy(&header->checksum, buffer + 8, sizeof(header->checksum));
     memcpy(&header->length, buffer + 10, sizeof(header->length));
     memcpy(&header->type, buffer + 12, sizeof(header->type));
+    memcpy(&header->window, buffer + 13, sizeof(header->window));
 
     // Convert fields from network byte order to host byte order
     header->seq_num = ntohl(header->seq_num);
     header->ack_num = ntohl(header->ack_num);
     header->checksum = ntohs(header->checksum);
     header->length = ntohs(header->length);
+    header->window = ntohs(header->window);
+    if (header->length > MAX_PAYLOAD_SIZE) return -1;
 
     // Copy payload
     memcpy(packet->payload, buffer + HEADER_SIZE, header->length);
+    return 0;
 }
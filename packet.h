@@ -7,7 +7,12 @@
 #include <string.h>
 
 #define MAX_PAYLOAD_SIZE 1024 // Adjust as needed for MTU considerations
-#define HEADER_SIZE 13         // Size of PacketHeader when serialized
+#define HEADER_SIZE 15         // Size of PacketHeader when serialized
+#define CRC_SIZE 4             // CRC32C trailer on DATA packets when negotiated
+
+// Options proposed in the START payload (after the filename's NUL) and echoed back in its ACK
+#define START_OPT_CRC32C 0x01  // DATA packets carry a CRC32C trailer instead of the 16-bit checksum
+#define START_OPT_DIGEST 0x02  // END carries the SHA-256 of the whole file, its ACK the verdict
 
 typedef enum {
     PACKET_TYPE_DATA,
@@ -22,6 +27,7 @@ typedef struct {
     uint16_t checksum;   // Checksum for error detection
     uint16_t length;     // Length of the payload
     uint8_t type;        // PacketType
+    uint16_t window;     // Receiver's advertised window in packets (ACK only)
 } __attribute__((packed)) PacketHeader;
 
 typedef struct {
@@ -31,7 +37,11 @@ typedef struct {
 
 // Function declarations
 uint16_t compute_checksum(uint8_t *data, size_t length);
+uint32_t compute_crc32c(uint32_t crc, const uint8_t *data, size_t length);
+int verify_checksum(uint8_t *buffer, size_t length);
+int verify_crc32c(uint8_t *buffer, size_t length);
 void serialize_packet(Packet *packet, uint8_t *buffer);
-void deserialize_packet(uint8_t *buffer, Packet *packet);
+void serialize_segment_header(PacketHeader *header, const uint8_t *payload, uint8_t *buffer, uint8_t *crc);
+int deserialize_packet(uint8_t *buffer, Packet *packet);
 
 #endif // PACKET_H
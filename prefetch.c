@@ -0,0 +1,179 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "prefetch.h"
+
+static void *prefetch_thread(void *arg) {
+    Prefetcher *pf = arg;
+    uint64_t offset = 0;
+
+    while (1) {
+        // Wait for a free block
+        pthread_mutex_lock(&pf->lock);
+        while (!pf->stop && pf->filled - pf->released >= PREFETCH_BLOCKS) {
+            pthread_cond_wait(&pf->cond, &pf->lock);
+        }
+        if (pf->stop) {
+            pthread_mutex_unlock(&pf->lock);
+            break;
+        }
+        PrefetchBlock *block = &pf->blocks[pf->filled % PREFETCH_BLOCKS];
+        block->length = 0;
+        block->offset = offset;
+        pf->filling = 1;
+        pthread_mutex_unlock(&pf->lock);
+
+        // Fill the block outside the lock; the consumer only reads below the published length
+        size_t length = 0;
+        int at_eof = 0;
+        int err = 0;
+        while (length < PREFETCH_BLOCK_SIZE) {
+            ssize_t n = read(pf->fd, block->data + length, PREFETCH_BLOCK_SIZE - length);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                err = errno;
+                break;
+            } else if (n == 0) {
+                at_eof = 1;
+                break;
+            }
+            // Hash on this thread while the bytes are still hot, so the digest costs no extra pass
+            sha256_update(&pf->hash, block->data + length, n);
+            length += n;
+
+            // Publish what we have so far, so slow pipes are not held back until the block is full
+            pthread_mutex_lock(&pf->lock);
+            block->length = length;
+            pthread_cond_broadcast(&pf->cond);
+            pthread_mutex_unlock(&pf->lock);
+        }
+
+        if (at_eof) sha256_final(&pf->hash, pf->digest);
+
+        // Complete the block
+        pthread_mutex_lock(&pf->lock);
+        offset += length;
+        if (length > 0) pf->filled++;
+        pf->filling = 0;
+        if (err) pf->error = err;
+        if (at_eof) pf->eof = 1;
+        pthread_cond_broadcast(&pf->cond);
+        pthread_mutex_unlock(&pf->lock);
+
+        if (err || at_eof) break;
+    }
+
+    return NULL;
+}
+
+int prefetch_init(Prefetcher *pf, int fd) {
+    memset(pf, 0, sizeof(*pf));
+    pf->fd = fd;
+    sha256_init(&pf->hash);
+
+    for (int i = 0; i < PREFETCH_BLOCKS; i++) {
+        pf->blocks[i].data = malloc(PREFETCH_BLOCK_SIZE);
+        if (!pf->blocks[i].data) {
+            for (int j = 0; j < i; j++) free(pf->blocks[j].data);
+            return -1;
+        }
+    }
+
+    // Hint the kernel to read ahead aggressively; fails harmlessly on pipes
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    if (pthread_create(&pf->thread, NULL, prefetch_thread, pf) != 0) {
+        pthread_mutex_destroy(&pf->lock);
+        pthread_cond_destroy(&pf->cond);
+        for (int i = 0; i < PREFETCH_BLOCKS; i++) free(pf->blocks[i].data);
+        return -1;
+    }
+    return 0;
+}
+
+// Cut the next slice of at most max_length bytes from the prefetched blocks.
+// The slice points into the block and stays valid until released.
+// Returns the slice length, 0 at end of file, or -1 on a read error (errno set).
+// Without wait, returns -1 with errno EAGAIN when no data is ready yet.
+ssize_t prefetch_next(Prefetcher *pf, const uint8_t **data, size_t max_length, int wait) {
+    pthread_mutex_lock(&pf->lock);
+    while (1) {
+        if (pf->consumed < pf->filled || (pf->consumed == pf->filled && pf->filling)) {
+            PrefetchBlock *block = &pf->blocks[pf->consumed % PREFETCH_BLOCKS];
+            if (pf->cursor < block->length) {
+                size_t length = block->length - pf->cursor;
+                if (length > max_length) length = max_length;
+                *data = block->data + pf->cursor;
+                pf->cursor += length;
+                pthread_mutex_unlock(&pf->lock);
+                return length;
+            }
+            if (pf->consumed < pf->filled) {
+                // Current block exhausted, move on to the next one
+                pf->consumed++;
+                pf->cursor = 0;
+                continue;
+            }
+        }
+        if (pf->consumed >= pf->filled && pf->error) {
+            errno = pf->error;
+            pthread_mutex_unlock(&pf->lock);
+            return -1;
+        }
+        if (pf->consumed >= pf->filled && pf->eof) {
+            pthread_mutex_unlock(&pf->lock);
+            return 0;
+        }
+        if (!wait) {
+            errno = EAGAIN;
+            pthread_mutex_unlock(&pf->lock);
+            return -1;
+        }
+        pthread_cond_wait(&pf->cond, &pf->lock);
+    }
+}
+
+// Hand back every block that lies entirely before the given file offset
+// so the reader thread can refill it.
+void prefetch_release(Prefetcher *pf, uint64_t offset) {
+    pthread_mutex_lock(&pf->lock);
+    int released = 0;
+    while (pf->released < pf->filled) {
+        PrefetchBlock *block = &pf->blocks[pf->released % PREFETCH_BLOCKS];
+        if (offset < block->offset + block->length) break;
+        if (pf->consumed == pf->released) {
+            // Fully cut but not yet stepped past; do not let the refill alias it
+            pf->consumed++;
+            pf->cursor = 0;
+        }
+        pf->released++;
+        released = 1;
+    }
+    if (released) pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+// SHA-256 of the whole input; only meaningful after prefetch_next has returned 0
+void prefetch_digest(Prefetcher *pf, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    pthread_mutex_lock(&pf->lock);
+    memcpy(digest, pf->digest, SHA256_DIGEST_SIZE);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+void prefetch_destroy(Prefetcher *pf) {
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = 1;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    pthread_join(pf->thread, NULL);
+
+    pthread_mutex_destroy(&pf->lock);
+    pthread_cond_destroy(&pf->cond);
+    for (int i = 0; i < PREFETCH_BLOCKS; i++) free(pf->blocks[i].data);
+}
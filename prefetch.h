@@ -0,0 +1,44 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "sha256.h"
+
+#define PREFETCH_BLOCK_SIZE (2 * 1024 * 1024) // Bytes pulled from the file per read-ahead block
+#define PREFETCH_BLOCKS 2                     // Double buffer: one block in flight, one filling
+
+typedef struct {
+    uint8_t *data;
+    size_t length;       // Valid bytes in data
+    uint64_t offset;     // File offset of data[0]
+} PrefetchBlock;
+
+typedef struct {
+    int fd;
+    PrefetchBlock blocks[PREFETCH_BLOCKS];
+    uint64_t filled;     // Number of blocks completed by the reader thread
+    int filling;         // Block number `filled` is being read and may already be cut from
+    uint64_t released;   // Number of blocks handed back by the consumer
+    uint64_t consumed;   // Block the consumer is currently cutting from
+    size_t cursor;       // Position inside the current block
+    int eof;             // Reader thread reached end of file
+    int error;           // errno of a failed read, 0 otherwise
+    int stop;            // Ask the reader thread to exit
+    Sha256 hash;         // Running hash of everything read, owned by the reader thread
+    uint8_t digest[SHA256_DIGEST_SIZE];  // Final hash, valid once eof is set
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Prefetcher;
+
+// Function declarations
+int prefetch_init(Prefetcher *pf, int fd);
+ssize_t prefetch_next(Prefetcher *pf, const uint8_t **data, size_t max_length, int wait);
+void prefetch_release(Prefetcher *pf, uint64_t offset);
+void prefetch_digest(Prefetcher *pf, uint8_t digest[SHA256_DIGEST_SIZE]);
+void prefetch_destroy(Prefetcher *pf);
+
+#endif // PREFETCH_H
@@ -1,5 +1,7 @@
 // recvfile.c
 
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,21 +10,68 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include "packet.h"
+#include "sha256.h"
 
-#define MAX_PACKET_SIZE (HEADER_SIZE + MAX_PAYLOAD_SIZE)
+#define MAX_PACKET_SIZE (HEADER_SIZE + MAX_PAYLOAD_SIZE + CRC_SIZE)
 #define WINDOW_SIZE 1000  // Adjusted to match sender's maximum window size
 
 typedef struct {
     Packet *packets[WINDOW_SIZE];
-    uint32_t base_seq_num;
+    uint32_t base_seq_num;   // Next in-order sequence number expected (cumulative ACK)
+    uint32_t write_seq_num;  // Next sequence number to write to the output
 } ReceiverWindow;
 
+// Free slots beyond the cumulative ACK; in-order packets hold their slot until written out
+static uint16_t advertised_window(ReceiverWindow *window) {
+    return window->write_seq_num + WINDOW_SIZE - window->base_seq_num;
+}
+
+// Write in-order packets to the output, feeding them to the file hash if one is kept.
+// When the output may block (a pipe), stop as soon as it is full so the socket keeps
+// being served and the shrinking window pushes back on the sender.
+static void flush_window(ReceiverWindow *window, FILE *fp, int may_block, Sha256 *hash) {
+    while (window->write_seq_num < window->base_seq_num) {
+        if (may_block) {
+            // POLLOUT guarantees room for PIPE_BUF bytes, more than one payload
+            struct pollfd pfd = { .fd = fileno(fp), .events = POLLOUT };
+            if (poll(&pfd, 1, 0) <= 0) break;
+        }
+        int index = window->write_seq_num % WINDOW_SIZE;
+        Packet *p = window->packets[index];
+        fwrite(p->payload, 1, p->header.length, fp);
+        if (hash) sha256_update(hash, p->payload, p->header.length);
+        free(p);
+        window->packets[index] = NULL;
+        window->write_seq_num++;
+    }
+}
+
+static void send_ack(int sockfd, uint32_t ack_num, uint16_t advertised, uint8_t *payload, uint16_t length,
+                     struct sockaddr_in *sender_addr, socklen_t addr_len) {
+    Packet ack_packet = {0};
+    ack_packet.header.type = PACKET_TYPE_ACK;
+    ack_packet.header.ack_num = ack_num;
+    ack_packet.header.window = advertised;
+    ack_packet.header.length = length;
+    if (length) memcpy(ack_packet.payload, payload, length);
+
+    // Serialize and compute checksum
+    uint8_t ack_buffer[MAX_PACKET_SIZE];
+    serialize_packet(&ack_packet, ack_buffer);
+
+    sendto(sockfd, ack_buffer, HEADER_SIZE + length, 0, (struct sockaddr *)sender_addr, addr_len);
+    printf("[send ack] Ack Num: %u Window: %u\n", ack_num, advertised);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 3 || strcmp(argv[1], "-p") != 0) {
-        fprintf(stderr, "Usage: recvfile -p <recv port>\n");
+    if ((argc != 3 && argc != 5) || strcmp(argv[1], "-p") != 0 ||
+        (argc == 5 && strcmp(argv[3], "-o") != 0)) {
+        fprintf(stderr, "Usage: recvfile -p <recv port> [-o <output file>|-]\n");
         exit(EXIT_FAILURE);
     }
+    char *output_path = argc == 5 ? argv[4] : NULL;
 
     uint16_t recv_port = atoi(argv[2]);
     if (recv_port < 18000 || recv_port > 18200) {
@@ -62,10 +111,51 @@ int main(int argc, char *argv[]) {
     FILE *fp = NULL;
     char filename[256] = {0};
     int expecting_start_packet = 1;
+    int streaming = output_path && strcmp(output_path, "-") == 0;
+    uint16_t last_advertised = WINDOW_SIZE;
+    uint8_t options = 0;  // START_OPT_* accepted for this transfer
+    Sha256 hash;
+    Sha256 *file_hash = NULL;  // &hash while the digest option is on
+
+    if (streaming) {
+        // Data owns stdout; move our log output over to stderr
+        int data_fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        fp = fdopen(data_fd, "wb");
+        if (!fp) {
+            perror("Failed to open stdout");
+            exit(EXIT_FAILURE);
+        }
+        setvbuf(fp, NULL, _IONBF, 0);  // Each payload goes out in one write, see flush_window
+    }
 
     printf("Receiver started, waiting for sender...\n");
 
     while (1) {
+        // While output is backed up, also wake when the pipe drains
+        int pending = window.write_seq_num < window.base_seq_num;
+        struct pollfd fds[2] = {
+            { .fd = sockfd, .events = POLLIN },
+            { .fd = fp ? fileno(fp) : -1, .events = POLLOUT },
+        };
+        if (poll(fds, pending ? 2 : 1, -1) < 0) {
+            perror("poll failed");
+            continue;
+        }
+        if (pending && fds[1].revents) {
+            flush_window(&window, fp, streaming, file_hash);
+            uint16_t advertised = advertised_window(&window);
+            if (last_advertised == 0 ||
+                advertised >= last_advertised + WINDOW_SIZE / 4) {
+                // Window reopened, tell the sender without waiting for its probe
+                send_ack(sockfd, window.base_seq_num, advertised, NULL, 0, &sender_addr, addr_len);
+                last_advertised = advertised;
+            }
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
         // Receive a packet from the sender
         num_bytes = recvfrom(sockfd, buffer, MAX_PACKET_SIZE, 0,
                              (struct sockaddr *)&sender_addr, &addr_len);
@@ -74,55 +164,56 @@ int main(int argc, char *argv[]) {
             continue;
         }
 
-        // Verify checksum
-        uint16_t received_checksum;
-        memcpy(&received_checksum, buffer + 8, sizeof(received_checksum));
-        received_checksum = ntohs(received_checksum);
-
-        // Zero out the checksum field in the buffer for calculation
-        buffer[8] = 0;
-        buffer[9] = 0;
-
-        // Compute checksum over the received packet
-        uint16_t computed_checksum = compute_checksum(buffer, num_bytes);
-
-        if (computed_checksum != received_checksum) {
+        // Verify checksum, or the CRC32C trailer DATA packets carry once it has been negotiated,
+        // then deserialize the packet
+        int valid = (options & START_OPT_CRC32C) && num_bytes > 12 && buffer[12] == PACKET_TYPE_DATA
+                        ? verify_crc32c(buffer, num_bytes)
+                        : verify_checksum(buffer, num_bytes);
+        Packet packet;
+        if (!valid || deserialize_packet(buffer, &packet) < 0) {
             printf("[recv corrupt packet]\n");
             continue; // Discard the packet
         }
 
-        // Deserialize the packet
-        Packet packet;
-        deserialize_packet(buffer, &packet);
-
         // Handle START packet
         if (packet.header.type == PACKET_TYPE_START && expecting_start_packet) {
-            strncpy(filename, (char *)packet.payload, packet.header.length);
-            filename[packet.header.length] = '\0';  // Ensure null-termination
-            strcat(filename, ".recv");
-            fp = fopen(filename, "wb");
-            if (!fp) {
-                perror("Failed to open file");
-                exit(EXIT_FAILURE);
+            // Payload is the filename, its NUL, then the options the sender proposes
+            uint8_t *nul = memchr(packet.payload, '\0', packet.header.length);
+            size_t name_length = nul ? (size_t)(nul - packet.payload) : packet.header.length;
+            if (name_length + 1 < packet.header.length) {
+                options = packet.payload[name_length + 1] & (START_OPT_CRC32C | START_OPT_DIGEST);
+            }
+            if (options & START_OPT_DIGEST) {
+                sha256_init(&hash);
+                file_hash = &hash;
+            }
+
+            if (output_path) {
+                strncpy(filename, output_path, sizeof(filename) - 1);
+            } else {
+                if (name_length > sizeof(filename) - 6) name_length = sizeof(filename) - 6;
+                memcpy(filename, packet.payload, name_length);
+                filename[name_length] = '\0';  // Ensure null-termination
+                strcat(filename, ".recv");
+            }
+            if (!streaming) {
+                fp = fopen(filename, "wb");
+                if (!fp) {
+                    perror("Failed to open file");
+                    exit(EXIT_FAILURE);
+                }
             }
             expecting_start_packet = 0;
             printf("[recv start packet] Filename: %s\n", filename);
 
             // Set base sequence number to the next expected sequence number
             window.base_seq_num = packet.header.seq_num + 1;
+            window.write_seq_num = window.base_seq_num;
             printf("[update base_seq_num] base_seq_num: %u\n", window.base_seq_num);
 
-            // Send ACK for the start packet
-            Packet ack_packet = {0};
-            ack_packet.header.type = PACKET_TYPE_ACK;
-            ack_packet.header.ack_num = window.base_seq_num;
-
-            // Serialize and compute checksum
-            uint8_t ack_buffer[HEADER_SIZE];
-            serialize_packet(&ack_packet, ack_buffer);
-
-            sendto(sockfd, ack_buffer, HEADER_SIZE, 0, (struct sockaddr *)&sender_addr, addr_len);
-            printf("[send ack] Ack Num: %u\n", ack_packet.header.ack_num);
+            // Send ACK for the start packet, echoing the options we accept
+            last_advertised = advertised_window(&window);
+            send_ack(sockfd, window.base_seq_num, last_advertised, &options, 1, &sender_addr, addr_len);
             continue;
         }
 
@@ -136,20 +227,8 @@ int main(int argc, char *argv[]) {
             uint32_t seq_num = packet.header.seq_num;
             printf("[recv data] Seq: %u Length: %u\n", seq_num, packet.header.length);
 
-            // Send ACK for the received packet
-            Packet ack_packet = {0};
-            ack_packet.header.type = PACKET_TYPE_ACK;
-            ack_packet.header.ack_num = seq_num + 1;
-
-            // Serialize and compute checksum
-            uint8_t ack_buffer[HEADER_SIZE];
-            serialize_packet(&ack_packet, ack_buffer);
-
-            sendto(sockfd, ack_buffer, HEADER_SIZE, 0, (struct sockaddr *)&sender_addr, addr_len);
-            printf("[send ack] Ack Num: %u\n", ack_packet.header.ack_num);
-
             // Check if the packet is within the window
-            if (seq_num >= window.base_seq_num && seq_num < window.base_seq_num + WINDOW_SIZE) {
+            if (seq_num >= window.base_seq_num && seq_num < window.write_seq_num + WINDOW_SIZE) {
                 int index = seq_num % WINDOW_SIZE;
 
                 // Store the packet if it hasn't been received before
@@ -158,35 +237,58 @@ int main(int argc, char *argv[]) {
                     memcpy(window.packets[index], &packet, sizeof(Packet));
                 }
 
-                // Deliver all in-order packets
-                while (window.packets[window.base_seq_num % WINDOW_SIZE]) {
-                    Packet *p = window.packets[window.base_seq_num % WINDOW_SIZE];
-                    fwrite(p->payload, 1, p->header.length, fp);
-                    free(p);
-                    window.packets[window.base_seq_num % WINDOW_SIZE] = NULL;
+                // Accept all in-order packets, then write out as many as the output takes
+                while (window.base_seq_num < window.write_seq_num + WINDOW_SIZE &&
+                       window.packets[window.base_seq_num % WINDOW_SIZE]) {
                     window.base_seq_num++;
                     printf("[slide window] new base_seq_num: %u\n", window.base_seq_num);
                 }
+                flush_window(&window, fp, streaming, file_hash);
             } else {
                 printf("[packet outside window] Seq: %u\n", seq_num);
             }
+
+            // Cumulative ACK carrying the space we have left
+            last_advertised = advertised_window(&window);
+            send_ack(sockfd, window.base_seq_num, last_advertised, NULL, 0, &sender_addr, addr_len);
         }
 
         // Handle END packet
         if (packet.header.type == PACKET_TYPE_END) {
             printf("[recv end packet]\n");
 
-            // Send ACK for the END packet
-            Packet ack_packet = {0};
-            ack_packet.header.type = PACKET_TYPE_ACK;
-            ack_packet.header.ack_num = packet.header.seq_num + 1;
-
-            // Serialize and compute checksum
-            uint8_t ack_buffer[HEADER_SIZE];
-            serialize_packet(&ack_packet, ack_buffer);
+            // Everything is acked by now; block until the output has taken the rest
+            flush_window(&window, fp, 0, file_hash);
+
+            // Compare our running hash with the sender's, the verdict rides on the END ACK
+            uint8_t verdict = 1;
+            if (file_hash && packet.header.length == SHA256_DIGEST_SIZE) {
+                uint8_t digest[SHA256_DIGEST_SIZE];
+                char digest_hex[2 * SHA256_DIGEST_SIZE + 1];
+                sha256_final(file_hash, digest);
+                sha256_hex(digest, digest_hex);
+                verdict = memcmp(digest, packet.payload, SHA256_DIGEST_SIZE) == 0;
+                if (verdict) {
+                    printf("[digest verified] sha256 %s\n", digest_hex);
+                } else {
+                    fprintf(stderr, "[digest mismatch] %s has sha256 %s\n", filename, digest_hex);
+                }
+            } else if (file_hash) {
+                // Digest was negotiated, so an END without one cannot be taken as verified
+                verdict = 0;
+                fprintf(stderr, "[digest mismatch] END carried %u bytes instead of a sha256\n",
+                        packet.header.length);
+            }
 
-            sendto(sockfd, ack_buffer, HEADER_SIZE, 0, (struct sockaddr *)&sender_addr, addr_len);
-            printf("[send ack] Ack Num: %u\n", ack_packet.header.ack_num);
+            // Send ACK for the END packet
+            send_ack(sockfd, packet.header.seq_num + 1, advertised_window(&window),
+                     (options & START_OPT_DIGEST) ? &verdict : NULL, (options & START_OPT_DIGEST) ? 1 : 0,
+                     &sender_addr, addr_len);
+            if (!verdict) {
+                if (fp) fclose(fp);
+                close(sockfd);
+                exit(EXIT_FAILURE);
+            }
             break;
         }
     }
@@ -7,28 +7,62 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <sys/time.h>
 #include <fcntl.h>
+#include <errno.h>
 #include "packet.h"
+#include "prefetch.h"
 
-#define MAX_PACKET_SIZE (HEADER_SIZE + MAX_PAYLOAD_SIZE)
+#define MAX_PACKET_SIZE (HEADER_SIZE + MAX_PAYLOAD_SIZE + CRC_SIZE)
 #define FIXED_RTO 500000      // Fixed Retransmission Timeout in microseconds (500 ms)
 #define MAX_CWND 1000.0       // Maximum congestion window size to limit memory usage
 #define WINDOW_SIZE 1000      // Should be at least as big as MAX_CWND
 
+// Unacked data must fit in all but one read-ahead block, so the reader always has a block to fill
+_Static_assert((long)WINDOW_SIZE * MAX_PAYLOAD_SIZE <= PREFETCH_BLOCK_SIZE * (PREFETCH_BLOCKS - 1),
+               "read-ahead blocks too small for the sender window");
+
+typedef struct {
+    PacketHeader header;
+    const uint8_t *payload;  // Slice of a read-ahead block, valid until acked
+} Segment;
+
 typedef struct {
-    Packet *packets[WINDOW_SIZE];
+    Segment *packets[WINDOW_SIZE];
     struct timeval time_sent[WINDOW_SIZE];
     int acked[WINDOW_SIZE];
     uint32_t base_seq_num;
     uint32_t next_seq_num;
 } SenderWindow;
 
+// Send a data segment with the integrity check negotiated in START. sendmsg gathers the header
+// (and CRC trailer) around the payload slice, so the payload is never copied out of its block.
+static void send_segment(int sockfd, Segment *packet, int use_crc32c,
+                         struct sockaddr_in *addr, socklen_t addr_len) {
+    uint8_t header[HEADER_SIZE];
+    uint8_t crc[CRC_SIZE];
+    serialize_segment_header(&packet->header, packet->payload, header, use_crc32c ? crc : NULL);
+
+    struct iovec iov[3] = {
+        { .iov_base = header, .iov_len = HEADER_SIZE },
+        { .iov_base = (void *)packet->payload, .iov_len = packet->header.length },
+        { .iov_base = crc, .iov_len = CRC_SIZE },
+    };
+    struct msghdr msg = {0};
+    msg.msg_name = addr;
+    msg.msg_namelen = addr_len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = use_crc32c ? 3 : 2;
+    sendmsg(sockfd, &msg, 0);
+}
+
 int main(int argc, char *argv[]) {
     // Argument validation
-    if (argc != 5 || strcmp(argv[1], "-r") != 0 || strcmp(argv[3], "-f") != 0) {
-        fprintf(stderr, "Usage: sendfile -r <recv host>:<recv port> -f <filename>\n");
+    if ((argc != 5 && argc != 6) || strcmp(argv[1], "-r") != 0 || strcmp(argv[3], "-f") != 0 ||
+        (argc == 6 && strcmp(argv[5], "-c") != 0)) {
+        fprintf(stderr, "Usage: sendfile -r <recv host>:<recv port> -f <filename>|- [-c]\n");
         exit(EXIT_FAILURE);
     }
 
@@ -47,14 +81,23 @@ int main(int argc, char *argv[]) {
     char *recv_host = recv_host_port;
     uint16_t recv_port = atoi(colon + 1);
 
-    // Open the file
-    int file_fd = open(file_path, O_RDONLY);
+    // Open the file, "-" streams from stdin until it is closed
+    int file_fd = strcmp(file_path, "-") == 0 ? STDIN_FILENO : open(file_path, O_RDONLY);
     if (file_fd < 0) {
         fprintf(stderr, "Failed to open file: %s\n", file_path);
         perror("Error");
         exit(EXIT_FAILURE);
     }
 
+    // Start reading the file ahead in large blocks
+    Prefetcher prefetch;
+    if (prefetch_init(&prefetch, file_fd) < 0) {
+        perror("Failed to start read-ahead");
+        close(file_fd);
+        exit(EXIT_FAILURE);
+    }
+    uint64_t acked_bytes = 0;  // File offset up to which every byte has been acked
+
     // Create a UDP socket
     int sockfd;
     struct sockaddr_in recv_addr;
@@ -92,15 +135,29 @@ int main(int argc, char *argv[]) {
     int dup_ack_count = 0;
     uint32_t last_ack_num = 0;
 
+    // Flow Control Variables
+    uint32_t rwnd = WINDOW_SIZE;  // Receiver's advertised window, updated by every ACK
+    int zero_window_probe = 0;    // Let one segment past a zero window so a lost update cannot stall us
+
     // Set socket timeout for recvfrom
     struct timeval timeout;
 
-    // Send start packet with filename
+    // Integrity options: always ask for the end-to-end digest, CRC32C segments with -c
+    uint8_t options = START_OPT_DIGEST;
+    if (argc == 6) options |= START_OPT_CRC32C;
+
+    // Send start packet with filename, its NUL, then the options we propose
     Packet start_packet = {0};
     start_packet.header.seq_num = window.next_seq_num++;
     start_packet.header.type = PACKET_TYPE_START;
-    start_packet.header.length = strlen(file_path);
-    memcpy(start_packet.payload, file_path, start_packet.header.length);
+    size_t name_length = strlen(file_path);
+    if (name_length + 2 > MAX_PAYLOAD_SIZE) {
+        fprintf(stderr, "Filename too long: %s\n", file_path);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(start_packet.payload, file_path, name_length + 1);
+    start_packet.payload[name_length + 1] = options;
+    start_packet.header.length = name_length + 2;
 
     // Serialize packet (checksum computed inside serialize_packet)
     serialize_packet(&start_packet, buffer);
@@ -118,32 +175,24 @@ int main(int argc, char *argv[]) {
         num_bytes = recvfrom(sockfd, buffer, MAX_PACKET_SIZE, 0,
                              (struct sockaddr *)&recv_addr, &addr_len);
         if (num_bytes > 0) {
-            // Verify checksum of received ACK packet
-            uint16_t received_checksum;
-            memcpy(&received_checksum, buffer + 8, sizeof(received_checksum));
-            received_checksum = ntohs(received_checksum);
-
-            // Zero out the checksum field in the buffer for calculation
-            buffer[8] = 0;
-            buffer[9] = 0;
-
-            // Compute checksum over the received packet
-            uint16_t computed_checksum = compute_checksum(buffer, num_bytes);
-
-            if (computed_checksum != received_checksum) {
+            // Verify checksum of received ACK packet and deserialize it
+            Packet ack_packet;
+            if (!verify_checksum(buffer, num_bytes) || deserialize_packet(buffer, &ack_packet) < 0) {
                 printf("[recv corrupt ack]\n");
                 continue; // Discard the packet
             }
 
-            // Deserialize the packet
-            Packet ack_packet;
-            deserialize_packet(buffer, &ack_packet);
-
             if (ack_packet.header.type == PACKET_TYPE_ACK &&
                 ack_packet.header.ack_num == start_packet.header.seq_num + 1) {
-                printf("[recv ack] Ack Num: %u\n", ack_packet.header.ack_num);
+                printf("[recv ack] Ack Num: %u Window: %u\n", ack_packet.header.ack_num, ack_packet.header.window);
                 // Update base_seq_num
                 window.base_seq_num = ack_packet.header.ack_num;
+                rwnd = ack_packet.header.window;
+                // The receiver echoes the options it accepted
+                options &= ack_packet.header.length >= 1 ? ack_packet.payload[0] : 0;
+                printf("[negotiated] crc32c: %s, digest: %s\n",
+                       (options & START_OPT_CRC32C) ? "on" : "off",
+                       (options & START_OPT_DIGEST) ? "on" : "off");
                 printf("[update base_seq_num] base_seq_num: %u\n", window.base_seq_num);
                 break;
             }
@@ -159,45 +208,50 @@ int main(int argc, char *argv[]) {
     }
 
     // Main data transmission loop
+    int use_crc32c = (options & START_OPT_CRC32C) != 0;
     int eof = 0;
     while (!eof || window.base_seq_num < window.next_seq_num) {
         // Send packets within the window
+        uint32_t send_limit = (rwnd == 0 && zero_window_probe) ? 1 : rwnd;
         while (!eof && window.next_seq_num < window.base_seq_num + (uint32_t)cwnd &&
-               window.next_seq_num < window.base_seq_num + (uint32_t)max_cwnd) {
-            Packet *packet = malloc(sizeof(Packet));
-            memset(packet, 0, sizeof(Packet));
-            packet->header.seq_num = window.next_seq_num++;
-            packet->header.type = PACKET_TYPE_DATA;
-
-            // Read data from file
-            packet->header.length = read(file_fd, packet->payload, MAX_PAYLOAD_SIZE);
-            if (packet->header.length < 0) {
+               window.next_seq_num < window.base_seq_num + (uint32_t)max_cwnd &&
+               window.next_seq_num < window.base_seq_num + send_limit) {
+            // Cut the next payload from the read-ahead blocks, only waiting for input when nothing is in flight
+            const uint8_t *payload;
+            int idle = window.base_seq_num == window.next_seq_num;
+            ssize_t length = prefetch_next(&prefetch, &payload, MAX_PAYLOAD_SIZE, idle);
+            if (length < 0 && errno == EAGAIN) {
+                break;  // Input not ready yet, go serve ACKs
+            } else if (length < 0) {
                 perror("File read error");
-                free(packet);
+                prefetch_destroy(&prefetch);
                 close(file_fd);
                 close(sockfd);
                 exit(EXIT_FAILURE);
-            } else if (packet->header.length == 0) {
+            } else if (length == 0) {
                 eof = 1;
-                free(packet);
-                window.next_seq_num--;  // Adjust seq_num as no data was read
                 break;
             }
 
+            Segment *packet = malloc(sizeof(Segment));
+            memset(packet, 0, sizeof(Segment));
+            packet->header.seq_num = window.next_seq_num++;
+            packet->header.type = PACKET_TYPE_DATA;
+            packet->header.length = length;
+            packet->payload = payload;
+
             // Store packet in window
             int index = packet->header.seq_num % WINDOW_SIZE;  // Use modulo for circular buffer
             window.packets[index] = packet;
             window.acked[index] = 0;
             gettimeofday(&window.time_sent[index], NULL);
 
-            // Serialize packet (checksum computed inside serialize_packet)
-            serialize_packet(packet, buffer);
-            // Send packet
-            sendto(sockfd, buffer, HEADER_SIZE + packet->header.length, 0,
-                   (struct sockaddr *)&recv_addr, addr_len);
+            // Send packet (checksum or CRC computed inside send_segment)
+            send_segment(sockfd, packet, use_crc32c, &recv_addr, addr_len);
             printf("[send data] Seq: %u Length: %u\n", packet->header.seq_num, packet->header.length);
-            printf("[debug] base_seq_num: %u, next_seq_num: %u, cwnd: %.2f, ssthresh: %.2f\n",
-                   window.base_seq_num, window.next_seq_num, cwnd, ssthresh);
+            printf("[debug] base_seq_num: %u, next_seq_num: %u, cwnd: %.2f, ssthresh: %.2f, rwnd: %u\n",
+                   window.base_seq_num, window.next_seq_num, cwnd, ssthresh, rwnd);
+            zero_window_probe = 0;
         }
 
         // Adjust socket timeout to fixed RTO
@@ -205,39 +259,32 @@ int main(int argc, char *argv[]) {
         timeout.tv_usec = (int)(FIXED_RTO - (timeout.tv_sec * 1000000));
         setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-        // Receive ACKs
+        // Receive ACKs: wait for the first one, then drain whatever else is queued without blocking
         num_bytes = recvfrom(sockfd, buffer, MAX_PACKET_SIZE, 0,
                              (struct sockaddr *)&recv_addr, &addr_len);
+        if (num_bytes <= 0 && rwnd == 0 && window.base_seq_num == window.next_seq_num) {
+            printf("[zero window probe]\n");
+            zero_window_probe = 1;
+        }
         while (num_bytes > 0) {
-            // Verify checksum of received ACK packet
-            uint16_t received_checksum;
-            memcpy(&received_checksum, buffer + 8, sizeof(received_checksum));
-            received_checksum = ntohs(received_checksum);
-
-            // Zero out the checksum field in the buffer for calculation
-            buffer[8] = 0;
-            buffer[9] = 0;
-
-            // Compute checksum over the received packet
-            uint16_t computed_checksum = compute_checksum(buffer, num_bytes);
-
-            if (computed_checksum != received_checksum) {
+            // Verify checksum of received ACK packet and deserialize it
+            Packet ack_packet;
+            if (!verify_checksum(buffer, num_bytes) || deserialize_packet(buffer, &ack_packet) < 0) {
                 printf("[recv corrupt ack]\n");
                 // Try receiving the next packet
-                num_bytes = recvfrom(sockfd, buffer, MAX_PACKET_SIZE, 0,
+                num_bytes = recvfrom(sockfd, buffer, MAX_PACKET_SIZE, MSG_DONTWAIT,
                                      (struct sockaddr *)&recv_addr, &addr_len);
                 continue; // Discard the packet
             }
 
-            // Deserialize the packet
-            Packet ack_packet;
-            deserialize_packet(buffer, &ack_packet);
-
             if (ack_packet.header.type == PACKET_TYPE_ACK) {
                 uint32_t ack_num = ack_packet.header.ack_num;
-                printf("[recv ack] Ack Num: %u\n", ack_num);
+                uint32_t ack_window = ack_packet.header.window;
+                printf("[recv ack] Ack Num: %u Window: %u\n", ack_num, ack_window);
 
                 if (ack_num > window.base_seq_num) {
+                    rwnd = ack_window;
+
                     // Successful ACK, reset duplicate ACK count
                     dup_ack_count = 0;
                     last_ack_num = ack_num;
@@ -246,12 +293,14 @@ int main(int argc, char *argv[]) {
                     for (uint32_t i = window.base_seq_num; i < ack_num; i++) {
                         int idx = i % WINDOW_SIZE;  // Use modulo for circular buffer
                         if (window.packets[idx]) {
+                            acked_bytes += window.packets[idx]->header.length;
                             free(window.packets[idx]);
                             window.packets[idx] = NULL;
                             window.acked[idx] = 1;
                         }
                     }
                     window.base_seq_num = ack_num;  // Slide the window
+                    prefetch_release(&prefetch, acked_bytes);
                     printf("[slide window] new base_seq_num: %u\n", window.base_seq_num);
 
                     // Update cwnd
@@ -266,6 +315,12 @@ int main(int argc, char *argv[]) {
                     // Ensure cwnd does not exceed max_cwnd
                     if (cwnd > max_cwnd) cwnd = max_cwnd;
 
+                } else if (ack_num == window.base_seq_num &&
+                           (ack_window != rwnd || ack_window == 0 ||
+                            window.base_seq_num == window.next_seq_num)) {
+                    // Window update, or the receiver answering a zero window probe; not a loss signal
+                    rwnd = ack_window;
+                    printf("[window update] rwnd: %u\n", rwnd);
                 } else if (ack_num == window.base_seq_num) {
                     // Duplicate ACK
                     dup_ack_count++;
@@ -278,11 +333,9 @@ int main(int argc, char *argv[]) {
 
                         // Retransmit the missing packet
                         int index = window.base_seq_num % WINDOW_SIZE;
-                        Packet *packet = window.packets[index];
+                        Segment *packet = window.packets[index];
                         if (packet) {
-                            serialize_packet(packet, buffer);
-                            sendto(sockfd, buffer, HEADER_SIZE + packet->header.length, 0,
-                                   (struct sockaddr *)&recv_addr, addr_len);
+                            send_segment(sockfd, packet, use_crc32c, &recv_addr, addr_len);
                             gettimeofday(&window.time_sent[index], NULL);
                             printf("[retransmit data] Seq: %u Length: %u\n", packet->header.seq_num, packet->header.length);
                         }
@@ -294,7 +347,7 @@ int main(int argc, char *argv[]) {
             }
 
             // Try receiving the next packet
-            num_bytes = recvfrom(sockfd, buffer, MAX_PACKET_SIZE, 0,
+            num_bytes = recvfrom(sockfd, buffer, MAX_PACKET_SIZE, MSG_DONTWAIT,
                                  (struct sockaddr *)&recv_addr, &addr_len);
         }
 
@@ -309,16 +362,17 @@ int main(int argc, char *argv[]) {
                 if (elapsed >= FIXED_RTO * 1.5) {
                     // Timeout occurred
                     printf("[timeout] Seq: %u\n", window.packets[index]->header.seq_num);
-                    ssthresh = cwnd / 2;
-                    if (ssthresh < 1) ssthresh = 1;
-                    cwnd = 1.0; // Reset cwnd to 1
+                    if (rwnd > 0) {
+                        // A probe lost to a closed window says nothing about congestion
+                        ssthresh = cwnd / 2;
+                        if (ssthresh < 1) ssthresh = 1;
+                        cwnd = 1.0; // Reset cwnd to 1
+                    }
                     dup_ack_count = 0;
 
                     // Retransmit packet
-                    Packet *packet = window.packets[index];
-                    serialize_packet(packet, buffer);
-                    sendto(sockfd, buffer, HEADER_SIZE + packet->header.length, 0,
-                           (struct sockaddr *)&recv_addr, addr_len);
+                    Segment *packet = window.packets[index];
+                    send_segment(sockfd, packet, use_crc32c, &recv_addr, addr_len);
                     gettimeofday(&window.time_sent[index], NULL);
                     printf("[retransmit data] Seq: %u Length: %u\n", packet->header.seq_num, packet->header.length);
                 }
@@ -326,18 +380,25 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    // Send end packet
+    // Send end packet, carrying the digest the read-ahead thread computed along the way
     Packet end_packet = {0};
     end_packet.header.seq_num = window.next_seq_num++;
     end_packet.header.type = PACKET_TYPE_END;
+    char digest_hex[2 * SHA256_DIGEST_SIZE + 1] = "";
+    if (options & START_OPT_DIGEST) {
+        prefetch_digest(&prefetch, end_packet.payload);
+        end_packet.header.length = SHA256_DIGEST_SIZE;
+        sha256_hex(end_packet.payload, digest_hex);
+    }
 
     // Serialize packet (checksum computed inside serialize_packet)
     serialize_packet(&end_packet, buffer);
-    sendto(sockfd, buffer, HEADER_SIZE, 0,
+    sendto(sockfd, buffer, HEADER_SIZE + end_packet.header.length, 0,
            (struct sockaddr *)&recv_addr, addr_len);
     printf("[send end packet] Seq: %u\n", end_packet.header.seq_num);
 
     // Wait for ACK of end packet
+    int digest_ok = 0;
     while (1) {
         // Set socket timeout to fixed RTO
         timeout.tv_sec = (int)(FIXED_RTO / 1000000);
@@ -347,30 +408,18 @@ int main(int argc, char *argv[]) {
         num_bytes = recvfrom(sockfd, buffer, MAX_PACKET_SIZE, 0,
                              (struct sockaddr *)&recv_addr, &addr_len);
         if (num_bytes > 0) {
-            // Verify checksum of received ACK packet
-            uint16_t received_checksum;
-            memcpy(&received_checksum, buffer + 8, sizeof(received_checksum));
-            received_checksum = ntohs(received_checksum);
-
-            // Zero out the checksum field in the buffer for calculation
-            buffer[8] = 0;
-            buffer[9] = 0;
-
-            // Compute checksum over the received packet
-            uint16_t computed_checksum = compute_checksum(buffer, num_bytes);
-
-            if (computed_checksum != received_checksum) {
+            // Verify checksum of received ACK packet and deserialize it
+            Packet ack_packet;
+            if (!verify_checksum(buffer, num_bytes) || deserialize_packet(buffer, &ack_packet) < 0) {
                 printf("[recv corrupt ack]\n");
                 continue; // Discard the packet
             }
 
-            // Deserialize the packet
-            Packet ack_packet;
-            deserialize_packet(buffer, &ack_packet);
-
             if (ack_packet.header.type == PACKET_TYPE_ACK &&
                 ack_packet.header.ack_num == end_packet.header.seq_num + 1) {
                 printf("[recv ack] Ack Num: %u\n", ack_packet.header.ack_num);
+                digest_ok = !(options & START_OPT_DIGEST) ||
+                            (ack_packet.header.length >= 1 && ack_packet.payload[0] == 1);
                 break;
             }
         } else {
@@ -378,15 +427,23 @@ int main(int argc, char *argv[]) {
             printf("[timeout waiting for ack of end packet]\n");
             // Re-serialize and send the end packet
             serialize_packet(&end_packet, buffer);
-            sendto(sockfd, buffer, HEADER_SIZE, 0,
+            sendto(sockfd, buffer, HEADER_SIZE + end_packet.header.length, 0,
                    (struct sockaddr *)&recv_addr, addr_len);
             printf("[resend end packet] Seq: %u\n", end_packet.header.seq_num);
         }
     }
 
     // Clean up
-    close(file_fd);
+    prefetch_destroy(&prefetch);
+    if (file_fd != STDIN_FILENO) close(file_fd);
     close(sockfd);
+    if (options & START_OPT_DIGEST) {
+        if (!digest_ok) {
+            fprintf(stderr, "[digest mismatch] receiver's copy differs from sha256 %s\n", digest_hex);
+            exit(EXIT_FAILURE);
+        }
+        printf("[digest verified] sha256 %s\n", digest_hex);
+    }
     printf("[completed]\n");
     return 0;
 }
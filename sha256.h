@@ -0,0 +1,22 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t bit_count;
+    uint8_t block[64];
+    size_t block_length;   // Bytes buffered in block
+} Sha256;
+
+// Function declarations
+void sha256_init(Sha256 *ctx);
+void sha256_update(Sha256 *ctx, const uint8_t *data, size_t length);
+void sha256_final(Sha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+void sha256_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char hex[2 * SHA256_DIGEST_SIZE + 1]);
+
+#endif // SHA256_H